@@ -41,12 +41,28 @@ PYBIND11_MODULE(wrappedfst, m) {
     .def_readwrite("weight", &Arc::weight)
     .def_readwrite("nextstate", &Arc::nextstate);
 
+  py::class_<GraphStats>(m, "GraphStats")
+    .def_readonly("num_states", &GraphStats::num_states)
+    .def_readonly("num_arcs", &GraphStats::num_arcs)
+    .def_readonly("num_accessible", &GraphStats::num_accessible)
+    .def_readonly("num_coaccessible", &GraphStats::num_coaccessible)
+    .def_readonly("num_unreachable", &GraphStats::num_unreachable)
+    .def_readonly("num_dead_end", &GraphStats::num_dead_end)
+    .def_readonly("has_epsilon_cycle", &GraphStats::has_epsilon_cycle)
+    .def_readonly("ilabel_counts", &GraphStats::ilabel_counts)
+    .def_readonly("olabel_counts", &GraphStats::olabel_counts)
+    .def_readonly("out_degree_counts", &GraphStats::out_degree_counts);
+
   py::class_<WrappedFst>(m, "WrappedFst")
     .def(py::init<>())
     .def(py::init<std::string>())
     .def("read", &WrappedFst::Read)
     .def("write", &WrappedFst::Write)
     .def("write_ark_entry", &WrappedFst::WriteArkEntry)
+    .def("write_compact", (void (WrappedFst::*)(std::string, double)) &WrappedFst::WriteCompact,
+         py::arg("fst_fpath"), py::arg("max_error")=0.)
+    .def("write_compact_ark_entry", &WrappedFst::WriteCompactArkEntry, py::arg("key"), py::arg("fst_fpath"),
+         py::arg("max_error")=0.)
     .def("read_ark_entries", &WrappedFst::ReadArkEntries)
     .def("add_state", &WrappedFst::AddState)
     .def("set_start", &WrappedFst::SetStart)
@@ -58,11 +74,13 @@ PYBIND11_MODULE(wrappedfst, m) {
     .def("minimize", &WrappedFst::Minimize)
     .def("arc_sort", &WrappedFst::ArcSort)
     .def("compose", &WrappedFst::Compose)
-    .def("shortest_path", &WrappedFst::ShortestPath)
+    .def("shortest_path", &WrappedFst::ShortestPath, py::arg("nshortest")=1, py::arg("unique")=false)
     .def("final", &WrappedFst::Final)
     .def("is_final", &WrappedFst::isFinal)
     .def("states", &WrappedFst::States)
     .def("connect", &WrappedFst::Connect)
+    .def("analyse", &WrappedFst::Analyse, py::arg("num_threads")=0, py::arg("connect")=false,
+         py::call_guard<py::gil_scoped_release>())
     .def("delete_arcs", &WrappedFst::DeleteArcs)
     .def("delete_states", &WrappedFst::DeleteStates)
     .def("num_states", &WrappedFst::NumStates)
@@ -123,4 +141,15 @@ PYBIND11_MODULE(wrappedfst, m) {
     .def("Value", &ArcIterator::Value)
     .def("SetValue", &ArcIterator::SetValue);
 
+  m.def("read_phone_map", &ReadPhoneMap);
+  m.def("write_unk_phone_fsts", &WriteUnkPhoneFsts, py::arg("post_fpath"), py::arg("unk_id"), py::arg("phone_map"),
+        py::arg("fst_fpath"), py::arg("num_threads")=0, py::call_guard<py::gil_scoped_release>());
+  m.def("read_symbols", &ReadSymbols);
+  m.def("decode_nbest", &DecodeNBest, py::arg("fsts"), py::arg("lm"), py::arg("nshortest"), py::arg("drop_labels"),
+        py::arg("symbols"), py::arg("separator")="", py::arg("num_threads")=0, py::arg("max_lm_copies")=4,
+        py::call_guard<py::gil_scoped_release>());
+  m.def("write_nbest_transcripts", &WriteNBestTranscripts, py::arg("fst_fpath"), py::arg("lm"), py::arg("nshortest"),
+        py::arg("drop_labels"), py::arg("symbols"), py::arg("out_fpath"), py::arg("separator")="",
+        py::arg("num_threads")=0, py::arg("max_lm_copies")=4, py::call_guard<py::gil_scoped_release>());
+
 }
@@ -17,11 +17,26 @@
 
 #include "fst/script/fstscript.h"
 #include "fst/script/arcsort.h"
+#include "fst/project.h"
+#include "fst/rmepsilon.h"
 #include "fst-wrapper.h"
 #include <pybind11/pybind11.h>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 #include <pybind11/stl.h>
 #include <pybind11/numpy.h>
 #include <pybind11/include/pybind11/pytypes.h>
@@ -45,13 +60,42 @@ void WrappedFst::SetFinal(int state, double weight) {
 }
 
 void WrappedFst::Read(std::string fst_fpath) {
-  fst_ = fst::script::VectorFstClass::Read(fst_fpath);
+  fst::script::VectorFstClass* new_fst;
+  std::ifstream fs(fst_fpath, std::ifstream::binary);
+  if (fs && IsCompact(fs)) {
+    new_fst = ReadCompact(fs, fst_fpath);
+  } else {
+    fs.close();
+    new_fst = fst::script::VectorFstClass::Read(fst_fpath);
+    if (new_fst == nullptr) throw std::runtime_error("Could not read " + fst_fpath);
+  }
+  delete fst_;
+  fst_ = new_fst;
 }
 
 void WrappedFst::Write(std::string fst_fpath) {
   fst_->Write(fst_fpath);
 }
 
+WrappedFst* WrappedFst::ReadArkEntry(std::istream& strm, std::string source, std::string* key) {
+  key->clear();
+  strm >> *key;
+  if (key->empty()) return nullptr;
+  strm.get();  // space after the key
+  const fst::FstReadOptions opts(source);
+  fst::script::VectorFstClass* new_fst;
+  if (IsCompact(strm)) {
+    new_fst = ReadCompact(strm, source);
+  } else {
+    new_fst = fst::script::VectorFstClass::Read<fst::StdArc>(strm, opts);
+    if (new_fst == nullptr) throw std::runtime_error("Could not read entry " + *key + " in " + source);
+  }
+  WrappedFst* fst = new WrappedFst();
+  delete fst->fst_;
+  fst->fst_ = new_fst;
+  return fst;
+}
+
 void WrappedFst::WriteArkEntry(std::string key, std::string fst_fpath) {
   std::fstream fs;
   fs.open(fst_fpath, std::fstream::app | std::fstream::binary);
@@ -61,6 +105,333 @@ void WrappedFst::WriteArkEntry(std::string key, std::string fst_fpath) {
   fs.close();
 }
 
+static const uint32_t kCompactMagic = 0x54534643;  // "CFST"
+static const uint32_t kCompactVersion = 1;
+// magic, version, quantization step, number of states, number of arcs, start, header crc. The arcs follow in
+// chunks of a uint32 size, the data and its crc, ended by a chunk of size 0. So neither writing nor reading
+// needs the whole encoded graph in memory.
+static const size_t kCompactHeaderSize = 4 + 4 + 8 + 8 + 8 + 8 + 4;
+static const size_t kCompactChunkSize = 1 << 20;
+// A chunk is flushed once it reaches kCompactChunkSize, so it can exceed it by at most one encoded field.
+static const size_t kCompactMaxChunkSize = kCompactChunkSize + 64;
+// Larger quantized values would overflow the zigzag coding, such weights are stored as floats.
+static const double kMaxQuantized = 1e18;
+
+// The library is built with -Ofast, and -ffinite-math-only lets the compiler drop isinf/isnan checks,
+// so these look at the exponent bits instead.
+static bool IsFiniteBits(double x) {
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  return ((bits >> 52) & 0x7FF) != 0x7FF;
+}
+
+static bool IsFiniteBits(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  return ((bits >> 23) & 0xFF) != 0xFF;
+}
+
+static bool IsPosInfBits(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  return bits == 0x7F800000;
+}
+
+static uint32_t Crc32(const char* data, size_t size, uint32_t crc=0) {
+  static uint32_t table[256];
+  static bool table_init = [&]() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    return true;
+  }();
+  (void) table_init;
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+template<typename T>
+static void PutRaw(std::string& buf, T value) {
+  buf.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void PutVarint(std::string& buf, uint64_t value) {
+  while (value >= 0x80) {
+    buf.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  buf.push_back(static_cast<char>(value));
+}
+
+static void PutSigned(std::string& buf, int64_t value) {
+  PutVarint(buf, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+// Exact weights are stored as floats. Quantized ones as a varint where 0 is infinity, 1 means a float
+// follows (for weights that are not finite or too large to quantize) and otherwise the zigzag coded step
+// count plus 2.
+static void PutWeight(std::string& buf, float weight, double step) {
+  if (step == 0.) {
+    PutRaw(buf, weight);
+    return;
+  }
+  if (IsPosInfBits(weight)) {
+    PutVarint(buf, 0);
+    return;
+  }
+  double steps = weight / step;
+  if (!IsFiniteBits(weight) || !IsFiniteBits(steps) || std::fabs(steps) >= kMaxQuantized) {
+    PutVarint(buf, 1);
+    PutRaw(buf, weight);
+    return;
+  }
+  int64_t q = llround(steps);
+  PutVarint(buf, ((static_cast<uint64_t>(q) << 1) ^ static_cast<uint64_t>(q >> 63)) + 2);
+}
+
+// Collects encoded fields and writes them out as checksummed chunks.
+class CompactWriter {
+public:
+  explicit CompactWriter(std::ostream& strm): strm_(strm) { buf_.reserve(kCompactMaxChunkSize); }
+
+  std::string& Buffer() { return buf_; }
+
+  void MaybeFlush() {
+    if (buf_.size() >= kCompactChunkSize) Flush();
+  }
+
+  void Finish() {
+    Flush();
+    uint32_t end = 0;
+    strm_.write(reinterpret_cast<const char*>(&end), sizeof(end));
+  }
+
+private:
+  void Flush() {
+    if (buf_.empty()) return;
+    uint32_t size = buf_.size();
+    uint32_t crc = Crc32(buf_.data(), buf_.size());
+    strm_.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    strm_.write(buf_.data(), buf_.size());
+    strm_.write(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    buf_.clear();
+  }
+
+  std::ostream& strm_;
+  std::string buf_;
+};
+
+// Decodes fields from the chunks, reading and checking one chunk at a time.
+class CompactReader {
+public:
+  CompactReader(std::istream& strm, const std::string& source): strm_(strm), source_(source) {
+    buf_.reserve(kCompactMaxChunkSize);
+  }
+
+  uint8_t GetByte() {
+    if (pos_ == buf_.size()) Refill();
+    return static_cast<uint8_t>(buf_[pos_++]);
+  }
+
+  template<typename T>
+  T GetRaw() {
+    char bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); ++i) bytes[i] = static_cast<char>(GetByte());
+    T value;
+    memcpy(&value, bytes, sizeof(T));
+    return value;
+  }
+
+  uint64_t GetVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte = GetByte();
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) return value;
+    }
+    Corrupt();
+    return 0;
+  }
+
+  int64_t GetSigned() {
+    uint64_t value = GetVarint();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+
+  float GetWeight(double step) {
+    if (step == 0.) return GetRaw<float>();
+    uint64_t value = GetVarint();
+    if (value == 0) return std::numeric_limits<float>::infinity();
+    if (value == 1) return GetRaw<float>();
+    value -= 2;
+    int64_t q = static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    return static_cast<float>(q * step);
+  }
+
+  // The current chunk has to be used up and followed by the end marker.
+  void Finish() {
+    if (pos_ != buf_.size() || ReadChunkSize() != 0) Corrupt();
+  }
+
+  void Corrupt() const { throw std::runtime_error("Corrupt compact fst in " + source_); }
+
+private:
+  uint32_t ReadChunkSize() {
+    uint32_t size;
+    if (!strm_.read(reinterpret_cast<char*>(&size), sizeof(size))) {
+      throw std::runtime_error("Truncated compact fst in " + source_);
+    }
+    return size;
+  }
+
+  void Refill() {
+    uint32_t size = ReadChunkSize();
+    if (size == 0 || size > kCompactMaxChunkSize) Corrupt();
+    buf_.resize(size);
+    uint32_t crc;
+    if (!strm_.read(&buf_[0], size) || !strm_.read(reinterpret_cast<char*>(&crc), sizeof(crc))) {
+      throw std::runtime_error("Truncated compact fst in " + source_);
+    }
+    if (Crc32(buf_.data(), buf_.size()) != crc) throw std::runtime_error("Checksum mismatch in compact fst " + source_);
+    pos_ = 0;
+  }
+
+  std::istream& strm_;
+  const std::string& source_;
+  std::string buf_;
+  size_t pos_ = 0;
+};
+
+static void CheckMaxError(double max_error) {
+  if (!IsFiniteBits(max_error) || max_error < 0.) {
+    throw std::invalid_argument("max_error must be a finite value >= 0, got " + std::to_string(max_error));
+  }
+}
+
+void WrappedFst::WriteCompact(std::ostream& strm, double max_error) const {
+  CheckMaxError(max_error);
+  const fst::Fst<fst::StdArc>& ifst = *fst_->GetFst<fst::StdArc>();
+  double step = 2. * max_error;
+  int64_t num_states = NumStates(), num_arcs = 0;
+  for (int64_t state = 0; state < num_states; ++state) num_arcs += ifst.NumArcs(state);
+
+  std::string header;
+  PutRaw(header, kCompactMagic);
+  PutRaw(header, kCompactVersion);
+  PutRaw(header, step);
+  PutRaw(header, num_states);
+  PutRaw(header, num_arcs);
+  PutRaw<int64_t>(header, GetStart());
+  PutRaw(header, Crc32(header.data() + 4, header.size() - 4));
+  strm.write(header.data(), header.size());
+
+  CompactWriter writer(strm);
+  std::string& buf = writer.Buffer();
+  for (int64_t state = 0; state < num_states; ++state) {
+    PutVarint(buf, ifst.NumArcs(state));
+    PutWeight(buf, ifst.Final(state).Value(), step);
+    int64_t prev_ilabel = 0, prev_olabel = 0;
+    for (fst::ArcIterator<fst::StdFst> aiter(ifst, state); !aiter.Done(); aiter.Next()) {
+      const fst::StdArc& arc = aiter.Value();
+      PutSigned(buf, arc.ilabel - prev_ilabel);
+      PutSigned(buf, arc.olabel - prev_olabel);
+      PutSigned(buf, arc.nextstate - state);
+      PutWeight(buf, arc.weight.Value(), step);
+      prev_ilabel = arc.ilabel;
+      prev_olabel = arc.olabel;
+      writer.MaybeFlush();
+    }
+    writer.MaybeFlush();
+  }
+  writer.Finish();
+}
+
+void WrappedFst::WriteCompact(std::string fst_fpath, double max_error) {
+  CheckMaxError(max_error);
+  std::ofstream fs(fst_fpath, std::ofstream::binary | std::ofstream::trunc);
+  if (!fs) throw std::runtime_error("Could not open " + fst_fpath);
+  WriteCompact(fs, max_error);
+  fs.close();
+  if (!fs) throw std::runtime_error("Failed writing " + fst_fpath);
+}
+
+void WrappedFst::WriteCompactArkEntry(std::string key, std::string fst_fpath, double max_error) {
+  CheckMaxError(max_error);  // before the key is written
+  std::fstream fs;
+  fs.open(fst_fpath, std::fstream::app | std::fstream::binary);
+  fs << key;
+  fs << " ";
+  WriteCompact(fs, max_error);
+  fs.close();
+  if (!fs) throw std::runtime_error("Failed writing " + fst_fpath);
+}
+
+bool WrappedFst::IsCompact(std::istream& strm) {
+  uint32_t magic = 0;
+  std::streampos pos = strm.tellg();
+  strm.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+  bool compact = strm.gcount() == sizeof(magic) && magic == kCompactMagic;
+  strm.clear();
+  strm.seekg(pos);
+  return compact;
+}
+
+template<typename T>
+static T ReadField(const char*& p) {
+  T value;
+  memcpy(&value, p, sizeof(T));
+  p += sizeof(T);
+  return value;
+}
+
+fst::script::VectorFstClass* WrappedFst::ReadCompact(std::istream& strm, std::string source) {
+  char header[kCompactHeaderSize];
+  if (!strm.read(header, kCompactHeaderSize)) throw std::runtime_error("Could not read compact fst header in " + source);
+  const char* p = header;
+  if (ReadField<uint32_t>(p) != kCompactMagic) throw std::runtime_error("Not a compact fst: " + source);
+  uint32_t version = ReadField<uint32_t>(p);
+  if (version != kCompactVersion) throw std::runtime_error("Unsupported compact fst version in " + source);
+  double step = ReadField<double>(p);
+  int64_t num_states = ReadField<int64_t>(p);
+  int64_t num_arcs = ReadField<int64_t>(p);
+  int64_t start = ReadField<int64_t>(p);
+  uint32_t header_crc = ReadField<uint32_t>(p);
+  if (Crc32(header + 4, kCompactHeaderSize - 8) != header_crc) {
+    throw std::runtime_error("Header checksum mismatch in compact fst " + source);
+  }
+  CompactReader reader(strm, source);
+  if (!IsFiniteBits(step) || step < 0. || num_states < 0 || num_arcs < 0 || start < -1 || start >= num_states) {
+    reader.Corrupt();
+  }
+
+  fst::StdVectorFst ofst;
+  ofst.ReserveStates(num_states);
+  for (int64_t state = 0; state < num_states; ++state) ofst.AddState();
+  int64_t arcs_read = 0;
+  for (int64_t state = 0; state < num_states; ++state) {
+    uint64_t state_arcs = reader.GetVarint();
+    if (state_arcs > static_cast<uint64_t>(num_arcs - arcs_read)) reader.Corrupt();
+    ofst.SetFinal(state, reader.GetWeight(step));
+    ofst.ReserveArcs(state, state_arcs);
+    int64_t ilabel = 0, olabel = 0;
+    for (uint64_t i = 0; i < state_arcs; ++i) {
+      ilabel += reader.GetSigned();
+      olabel += reader.GetSigned();
+      int64_t nextstate = state + reader.GetSigned();
+      if (nextstate < 0 || nextstate >= num_states) reader.Corrupt();
+      ofst.AddArc(state, fst::StdArc(ilabel, olabel, reader.GetWeight(step), nextstate));
+    }
+    arcs_read += state_arcs;
+  }
+  if (arcs_read != num_arcs) reader.Corrupt();
+  reader.Finish();
+  ofst.SetStart(start);
+  return new fst::script::VectorFstClass(ofst);
+}
+
 void WrappedFst::AddArc(int start_state, int next_state, int ilabel, int olabel, double weight) {
   fst::TropicalWeight w(weight);
   fst::StdArc arc(ilabel, olabel, w, next_state);
@@ -116,12 +487,12 @@ void WrappedFst::Compose(WrappedFst &other_fst) {
   fst_ = new_fst;
 }
 
-void WrappedFst::ShortestPath() {
+void WrappedFst::ShortestPath(int nshortest, bool unique) {
   fst::script::VectorFstClass* new_fst = new fst::script::VectorFstClass(fst_->ArcType());
   const auto weight_threshold = fst::script::WeightClass::Zero(fst_->WeightType());
   fst::QueueType queue_type;
   fst::script::GetQueueType("auto", &queue_type);
-  const fst::script::ShortestPathOptions opts(queue_type, 1, true, 0.000976562, weight_threshold);
+  const fst::script::ShortestPathOptions opts(queue_type, nshortest, unique, 0.000976562, weight_threshold);
   fst::script::ShortestPath(*fst_, new_fst, opts);
   delete fst_;
   fst_ = new_fst;
@@ -270,17 +641,6 @@ void WrappedFst::ReplaceSingle(const int olabel, WrappedFst* fst) {
   }
 }
 
-//bool WrappedFst::CheckHasEpsilonLoop(int start, int end) {
-//  int current_state = start;
-//  while (true) {
-//    ArcIterator arc_iterator(*this, current_state);
-//    while (!arc_iterator.Done()) {
-//      Arc arc = arc_iterator.Value();
-//      arc_iterator.Next();
-//    }
-//  }
-//}
-
 WrappedFst* WrappedFst::Copy() const {
   WrappedFst* f = new WrappedFst;
   for (int state: this->States()) {
@@ -445,3 +805,604 @@ void WrappedFst::AddBoost(std::vector< std::vector<int>> word_subwords, double b
     ArcSort("ilabel");
   }
 }
+
+
+static int NumThreads(int num_threads) {
+  return num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// An exception escaping a std::thread terminates the process, so workers store the first one and it is
+// rethrown on the calling thread after all workers have joined.
+class WorkerError {
+public:
+  void Set() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_) error_ = std::current_exception();
+    failed_ = true;
+  }
+
+  bool Failed() const { return failed_; }
+
+  void Rethrow() {
+    if (error_) std::rethrow_exception(error_);
+  }
+
+private:
+  std::mutex mutex_;
+  std::exception_ptr error_;
+  std::atomic<bool> failed_{false};
+};
+
+// Calls fn(i) for i in [0, n), threads grab chunks of indices until none are left.
+template<typename F>
+static void ParallelFor(int n, int num_threads, F fn, int chunk=1) {
+  num_threads = NumThreads(num_threads);
+  num_threads = std::min(num_threads, (n + chunk - 1) / chunk);
+  if (num_threads <= 1) {
+    for (int i = 0; i < n; ++i) fn(i);
+    return;
+  }
+  std::atomic<int> next(0);
+  WorkerError error;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&]() {
+      try {
+        int begin;
+        while (!error.Failed() && (begin = next.fetch_add(chunk)) < n) {
+          int end = std::min(begin + chunk, n);
+          for (int i = begin; i < end; ++i) fn(i);
+        }
+      } catch (...) {
+        error.Set();
+      }
+    });
+  }
+  for (std::thread& thread: threads) thread.join();
+  error.Rethrow();
+}
+
+// Calls fn(thread, begin, end) on num_threads contiguous parts of [0, n).
+template<typename F>
+static void ParallelRange(int64_t n, int num_threads, F fn) {
+  num_threads = static_cast<int>(std::min<int64_t>(NumThreads(num_threads), std::max<int64_t>(n, 1)));
+  if (num_threads == 1) {
+    fn(0, 0, n);
+    return;
+  }
+  WorkerError error;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      try {
+        fn(t, n * t / num_threads, n * (t + 1) / num_threads);
+      } catch (...) {
+        error.Set();
+      }
+    });
+  }
+  for (std::thread& thread: threads) thread.join();
+  error.Rethrow();
+}
+
+static std::string StripPosition(const std::string& phone) {
+  size_t n = phone.size();
+  if (n > 2 && phone[n - 2] == '_' &&
+      (phone[n - 1] == 'B' || phone[n - 1] == 'I' || phone[n - 1] == 'S' || phone[n - 1] == 'E')) {
+    return phone.substr(0, n - 2);
+  }
+  return phone;
+}
+
+std::vector<int> ReadPhoneMap(std::string phones_fpath, std::string psym_fpath) {
+  std::unordered_map<std::string, int> psyms;
+  std::ifstream psym_fs(psym_fpath);
+  if (!psym_fs) throw std::runtime_error("Could not open " + psym_fpath);
+  std::string sym;
+  int id;
+  while (psym_fs >> sym >> id) psyms[sym] = id;
+
+  std::ifstream phones_fs(phones_fpath);
+  if (!phones_fs) throw std::runtime_error("Could not open " + phones_fpath);
+  std::vector<int> phone_map;
+  while (phones_fs >> sym >> id) {
+    if (id < 0) continue;
+    if (id >= phone_map.size()) phone_map.resize(id + 1, -1);
+    auto it = psyms.find(StripPosition(sym));
+    if (it != psyms.end()) phone_map[id] = it->second;
+  }
+  return phone_map;
+}
+
+struct UnkArcPost {
+  std::string key;
+  double posterior;
+  std::string phones;  // rest of the line, parsed by the worker
+};
+
+static WrappedFst* BuildPhoneFst(const UnkArcPost& post, const std::vector<int>& phone_map, std::atomic<int>& num_unmapped) {
+  WrappedFst* fst = new WrappedFst();
+  int state = fst->AddState();
+  fst->SetStart(state);
+  double weight = post.posterior > 0. ? -log(post.posterior) : std::numeric_limits<double>::infinity();
+  const char* p = post.phones.c_str();
+  char* end;
+  while (true) {
+    long phone = strtol(p, &end, 10);
+    if (end == p) break;
+    p = end;
+    if (phone < 0 || phone >= phone_map.size() || phone_map[phone] == -1) {
+      ++num_unmapped;
+      continue;
+    }
+    int next_state = fst->AddState();
+    fst->AddArc(state, next_state, phone_map[phone], phone_map[phone], weight);
+    weight = 0.;
+    state = next_state;
+  }
+  fst->SetFinal(state);
+  return fst;
+}
+
+// Parses "utt start num-frames posterior word phone1 phone2 ..." as written by lattice-arc-post, which separates
+// the fields up to the word by tabs and the phones by spaces. Only the fields up to the word are parsed, phones
+// is set to the offset of the rest of the line. Returns false if the line is malformed.
+static bool ParseArcPostLine(const std::string& line, std::string* key, double* posterior, long* word,
+                             size_t* phones) {
+  size_t key_end = line.find_first_of(" \t");
+  if (key_end == 0 || key_end == std::string::npos) return false;
+  const char* p = line.c_str() + key_end;
+  char* end;
+  strtol(p, &end, 10);  // start frame
+  if (end == p) return false;
+  p = end;
+  strtol(p, &end, 10);  // number of frames
+  if (end == p) return false;
+  p = end;
+  *posterior = strtod(p, &end);
+  if (end == p) return false;
+  p = end;
+  *word = strtol(p, &end, 10);
+  if (end == p) return false;
+  *key = line.substr(0, key_end);
+  *phones = end - line.c_str();
+  return true;
+}
+
+int WriteUnkPhoneFsts(std::string post_fpath, int unk_id, const std::vector<int>& phone_map,
+                      std::string fst_fpath, int num_threads) {
+  std::ifstream post_fs;
+  std::istream* is = &std::cin;
+  if (post_fpath != "-") {
+    post_fs.open(post_fpath);
+    if (!post_fs) throw std::runtime_error("Could not open " + post_fpath);
+    is = &post_fs;
+  }
+  std::vector<char> buffer(1 << 22);
+  std::ofstream os;
+  os.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+  os.open(fst_fpath, std::ofstream::binary | std::ofstream::trunc);
+  if (!os) throw std::runtime_error("Could not open " + fst_fpath);
+
+  const size_t batch_size = 4096;
+  std::vector<UnkArcPost> batch;
+  std::vector<WrappedFst*> fsts;
+  std::atomic<int> num_unmapped(0);
+  std::string line, key;
+  double posterior;
+  long word;
+  size_t phones;
+  int num_written = 0, num_malformed = 0;
+  bool done = false;
+  while (!done) {
+    batch.clear();
+    // Only the fields up to the word id are parsed here, the phones are left to the workers.
+    while (batch.size() < batch_size) {
+      if (!std::getline(*is, line)) {
+        done = true;
+        break;
+      }
+      if (line.empty()) continue;
+      if (!ParseArcPostLine(line, &key, &posterior, &word, &phones)) {
+        std::cerr << "Malformed lattice-arc-post line: " << line << std::endl;
+        ++num_malformed;
+        continue;
+      }
+      if (word != unk_id) continue;
+      batch.push_back({key, posterior, line.substr(phones)});
+    }
+
+    fsts.assign(batch.size(), nullptr);
+    ParallelFor(batch.size(), num_threads, [&](int i) {
+      fsts[i] = BuildPhoneFst(batch[i], phone_map, num_unmapped);
+    }, 64);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      os << batch[i].key << " ";
+      fsts[i]->fst_->Write(os, fst_fpath);
+      delete fsts[i];
+      ++num_written;
+    }
+  }
+  os.close();
+  if (!os) throw std::runtime_error("Failed writing " + fst_fpath);
+  if (num_malformed > 0) std::cerr << "Skipped " << num_malformed << " malformed lines" << std::endl;
+  if (num_unmapped > 0) {
+    std::cerr << "Skipped " << num_unmapped << " phones without a position free id" << std::endl;
+  }
+  return num_written;
+}
+
+std::vector<std::string> ReadSymbols(std::string sym_fpath) {
+  std::ifstream fs(sym_fpath);
+  if (!fs) throw std::runtime_error("Could not open " + sym_fpath);
+  std::vector<std::string> symbols;
+  std::string sym;
+  int id;
+  while (fs >> sym >> id) {
+    if (id < 0) continue;
+    if (id >= symbols.size()) symbols.resize(id + 1);
+    symbols[id] = sym;
+  }
+  return symbols;
+}
+
+// Collects the output strings of all paths of a ShortestPath result, cheapest first.
+static std::vector<std::string> PathStrings(const WrappedFst& fst, const std::vector<bool>& drop,
+                                            const std::vector<std::string>& symbols, const std::string& separator) {
+  std::vector<std::pair<double, std::string>> paths;
+  int start = fst.GetStart();
+  if (start != -1) {
+    std::vector<std::tuple<int, double, std::string>> stack;
+    stack.emplace_back(start, 0., "");
+    while (!stack.empty()) {
+      int state;
+      double cost;
+      std::string str;
+      std::tie(state, cost, str) = stack.back();
+      stack.pop_back();
+      if (fst.isFinal(state)) paths.emplace_back(cost + fst.Final(state), str);
+      for (Arc& arc: fst.GetArcs(state)) {
+        std::string next_str = str;
+        int label = arc.olabel;
+        if (label != 0 && !(label < drop.size() && drop[label])) {
+          if (!next_str.empty()) next_str += separator;
+          if (label < symbols.size() && !symbols[label].empty()) {
+            next_str += symbols[label];
+          } else {
+            next_str += std::to_string(label);
+          }
+        }
+        stack.emplace_back(arc.nextstate, cost + arc.weight, next_str);
+      }
+    }
+  }
+  std::stable_sort(paths.begin(), paths.end(),
+                   [](const std::pair<double, std::string>& a, const std::pair<double, std::string>& b) {
+                     return a.first < b.first;
+                   });
+  std::vector<std::string> strs;
+  for (auto& path: paths) strs.push_back(path.second);
+  return strs;
+}
+
+static std::vector<bool> LabelMask(const std::vector<int>& labels) {
+  std::vector<bool> mask;
+  for (int label: labels) {
+    if (label < 0) continue;
+    if (label >= mask.size()) mask.resize(label + 1, false);
+    mask[label] = true;
+  }
+  return mask;
+}
+
+// Composition copies the LM, but the copies share its implementation and the matchers update its cached
+// properties without locking. So a worker composes with a deep copy that no other thread uses at the same
+// time. At most max_copies are made (lazily, outside the lock), workers wait for a free one beyond that.
+class LmCopies {
+public:
+  LmCopies(const WrappedFst* lm, int max_copies): lm_(lm), max_copies_(std::max(1, max_copies)) {}
+
+  ~LmCopies() {
+    for (WrappedFst* copy: copies_) delete copy;
+  }
+
+  WrappedFst* Acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    free_cond_.wait(lock, [&]() { return !free_.empty() || num_copies_ < max_copies_; });
+    if (!free_.empty()) {
+      WrappedFst* copy = free_.back();
+      free_.pop_back();
+      return copy;
+    }
+    ++num_copies_;
+    lock.unlock();
+    // Copying only reads lm_, so several copies can be made at once.
+    std::unique_ptr<WrappedFst> copy;
+    try {
+      copy.reset(new WrappedFst());
+      delete copy->fst_;
+      copy->fst_ = nullptr;
+      copy->fst_ = new fst::script::VectorFstClass(fst::StdVectorFst(*lm_->fst_->GetFst<fst::StdArc>()));
+    } catch (...) {
+      lock.lock();
+      --num_copies_;
+      free_cond_.notify_one();
+      throw;
+    }
+    lock.lock();
+    copies_.push_back(copy.get());
+    return copy.release();
+  }
+
+  void Release(WrappedFst* copy) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(copy);
+    free_cond_.notify_one();
+  }
+
+private:
+  const WrappedFst* lm_;
+  const int max_copies_;
+  int num_copies_ = 0;
+  std::mutex mutex_;
+  std::condition_variable free_cond_;
+  std::vector<WrappedFst*> copies_;
+  std::vector<WrappedFst*> free_;
+};
+
+static std::vector<std::pair<std::string, std::vector<std::string>>> DecodeBatch(
+    const std::vector<std::pair<std::string, WrappedFst*>>& fsts, LmCopies* lms, int nshortest,
+    const std::vector<bool>& drop, const std::vector<std::string>& symbols, const std::string& separator,
+    int num_threads) {
+  std::vector<std::pair<std::string, std::vector<std::string>>> results(fsts.size());
+  ParallelFor(fsts.size(), num_threads, [&](int i) {
+    WrappedFst* fst = fsts[i].second;
+    if (lms != nullptr) {
+      WrappedFst* lm = lms->Acquire();
+      try {
+        fst->Compose(*lm);
+      } catch (...) {
+        lms->Release(lm);
+        throw;
+      }
+      lms->Release(lm);
+      if (fst->fst_->Properties(fst::kError, false)) {
+        throw std::runtime_error("Composing " + fsts[i].first + " with the lm failed, is the lm ilabel sorted?");
+      }
+    }
+    if (nshortest > 1) {
+      // Unique paths of the output acceptor are unique transcripts, and it can be determinized.
+      fst::MutableFst<fst::StdArc>* mfst = fst->fst_->GetMutableFst<fst::StdArc>();
+      fst::Project(mfst, fst::PROJECT_OUTPUT);
+      fst::RmEpsilon(mfst);
+    }
+    fst->ShortestPath(nshortest, nshortest > 1);
+    results[i].first = fsts[i].first;
+    results[i].second = PathStrings(*fst, drop, symbols, separator);
+  });
+  return results;
+}
+
+std::vector<std::pair<std::string, std::vector<std::string>>> DecodeNBest(
+    const std::vector<std::pair<std::string, WrappedFst*>>& fsts, WrappedFst* lm, int nshortest,
+    const std::vector<int>& drop_labels, const std::vector<std::string>& symbols, std::string separator,
+    int num_threads, int max_lm_copies) {
+  std::unique_ptr<LmCopies> lms(lm != nullptr ? new LmCopies(lm, max_lm_copies) : nullptr);
+  return DecodeBatch(fsts, lms.get(), nshortest, LabelMask(drop_labels), symbols, separator, num_threads);
+}
+
+int WriteNBestTranscripts(std::string fst_fpath, WrappedFst* lm, int nshortest, const std::vector<int>& drop_labels,
+                          const std::vector<std::string>& symbols, std::string out_fpath, std::string separator,
+                          int num_threads, int max_lm_copies) {
+  std::ifstream fs(fst_fpath, std::ifstream::binary);
+  if (!fs) throw std::runtime_error("Could not open " + fst_fpath);
+  std::ofstream os(out_fpath);
+  if (!os) throw std::runtime_error("Could not open " + out_fpath);
+  std::unique_ptr<LmCopies> lms(lm != nullptr ? new LmCopies(lm, max_lm_copies) : nullptr);
+  std::vector<bool> drop = LabelMask(drop_labels);
+
+  const size_t batch_size = 1024;
+  std::vector<std::pair<std::string, WrappedFst*>> batch;
+  std::string key;
+  int num_written = 0, num_empty = 0;
+  bool done = false;
+  while (!done) {
+    batch.clear();
+    std::vector<std::pair<std::string, std::vector<std::string>>> results;
+    try {
+      while (batch.size() < batch_size) {
+        WrappedFst* fst = WrappedFst::ReadArkEntry(fs, fst_fpath, &key);
+        if (fst == nullptr) {
+          done = true;
+          break;
+        }
+        batch.emplace_back(key, fst);
+      }
+      results = DecodeBatch(batch, lms.get(), nshortest, drop, symbols, separator, num_threads);
+    } catch (...) {
+      for (auto& entry: batch) delete entry.second;
+      throw;
+    }
+    for (auto& entry: batch) delete entry.second;
+
+    for (auto& result: results) {
+      if (result.second.empty()) ++num_empty;
+      for (size_t rank = 0; rank < result.second.size(); ++rank) {
+        os << result.first;
+        if (nshortest > 1) os << "-" << rank + 1;
+        os << " " << result.second[rank] << "\n";
+        ++num_written;
+      }
+    }
+  }
+  os.close();
+  if (!os) throw std::runtime_error("Failed writing " + out_fpath);
+  if (num_empty > 0) std::cerr << "No path found for " << num_empty << " fsts" << std::endl;
+  return num_written;
+}
+
+// Below this many states a level of a traversal is not worth starting threads for.
+static const size_t kMinParallelFrontier = 4096;
+
+// Level synchronous breadth first search over the flattened graph (offsets index into targets),
+// returns which states are reachable from sources.
+static std::vector<char> Reach(std::vector<int> sources, const std::vector<int64_t>& offsets,
+                               const std::vector<int>& targets, int num_threads) {
+  int n = offsets.size() - 1;
+  std::unique_ptr<std::atomic<char>[]> visited(new std::atomic<char>[n]);
+  ParallelRange(n, num_threads, [&](int t, int64_t begin, int64_t end) {
+    for (int64_t s = begin; s < end; ++s) visited[s].store(0, std::memory_order_relaxed);
+  });
+  std::vector<int> frontier;
+  for (int s: sources) {
+    if (!visited[s].exchange(1)) frontier.push_back(s);
+  }
+  std::vector<std::vector<int>> next(num_threads);
+  while (!frontier.empty()) {
+    for (std::vector<int>& v: next) v.clear();
+    int level_threads = frontier.size() < kMinParallelFrontier ? 1 : num_threads;
+    ParallelRange(frontier.size(), level_threads, [&](int t, int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        int s = frontier[i];
+        for (int64_t a = offsets[s]; a < offsets[s + 1]; ++a) {
+          int d = targets[a];
+          if (!visited[d].load(std::memory_order_relaxed) && !visited[d].exchange(1)) next[t].push_back(d);
+        }
+      }
+    });
+    frontier.clear();
+    for (std::vector<int>& v: next) frontier.insert(frontier.end(), v.begin(), v.end());
+  }
+  std::vector<char> reached(n);
+  ParallelRange(n, num_threads, [&](int t, int64_t begin, int64_t end) {
+    for (int64_t s = begin; s < end; ++s) reached[s] = visited[s].load(std::memory_order_relaxed);
+  });
+  return reached;
+}
+
+// Kahn's algorithm on the input epsilon arcs, if not all states can be removed there is a cycle.
+static bool HasEpsilonCycle(const std::vector<int64_t>& offsets, const std::vector<int>& targets,
+                            const std::vector<char>& arc_eps, int num_threads) {
+  int n = offsets.size() - 1;
+  std::unique_ptr<std::atomic<int>[]> in_degree(new std::atomic<int>[n]);
+  ParallelRange(n, num_threads, [&](int t, int64_t begin, int64_t end) {
+    for (int64_t s = begin; s < end; ++s) in_degree[s].store(0, std::memory_order_relaxed);
+  });
+  ParallelRange(n, num_threads, [&](int t, int64_t begin, int64_t end) {
+    for (int64_t a = offsets[begin]; a < offsets[end]; ++a) {
+      if (arc_eps[a]) in_degree[targets[a]].fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+  std::vector<std::vector<int>> next(num_threads);
+  ParallelRange(n, num_threads, [&](int t, int64_t begin, int64_t end) {
+    for (int64_t s = begin; s < end; ++s) {
+      if (in_degree[s].load(std::memory_order_relaxed) == 0) next[t].push_back(s);
+    }
+  });
+  std::vector<int> frontier;
+  int64_t num_removed = 0;
+  while (true) {
+    frontier.clear();
+    for (std::vector<int>& v: next) {
+      frontier.insert(frontier.end(), v.begin(), v.end());
+      v.clear();
+    }
+    if (frontier.empty()) break;
+    num_removed += frontier.size();
+    int level_threads = frontier.size() < kMinParallelFrontier ? 1 : num_threads;
+    ParallelRange(frontier.size(), level_threads, [&](int t, int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        int s = frontier[i];
+        for (int64_t a = offsets[s]; a < offsets[s + 1]; ++a) {
+          if (arc_eps[a] && in_degree[targets[a]].fetch_sub(1) == 1) next[t].push_back(targets[a]);
+        }
+      }
+    });
+  }
+  return num_removed < n;
+}
+
+GraphStats WrappedFst::Analyse(int num_threads, bool connect) {
+  num_threads = NumThreads(num_threads);
+  const fst::Fst<fst::StdArc>& ifst = *fst_->GetFst<fst::StdArc>();
+  GraphStats stats;
+  int n = NumStates();
+  stats.num_states = n;
+
+  // Flattening the graph, arcs of state s are at [offsets[s], offsets[s + 1]).
+  std::vector<int64_t> offsets(n + 1, 0);
+  std::vector<char> final(n);
+  ParallelRange(n, num_threads, [&](int t, int64_t begin, int64_t end) {
+    for (int64_t s = begin; s < end; ++s) {
+      offsets[s + 1] = ifst.NumArcs(s);
+      final[s] = ifst.Final(s) != fst::TropicalWeight::Zero();
+    }
+  });
+  for (int s = 0; s < n; ++s) offsets[s + 1] += offsets[s];
+  int64_t num_arcs = offsets[n];
+  stats.num_arcs = num_arcs;
+
+  std::vector<int> targets(num_arcs);
+  std::vector<char> arc_eps(num_arcs);
+  std::vector<std::unordered_map<int, int64_t>> ilabel_counts(num_threads), olabel_counts(num_threads);
+  std::vector<std::vector<int64_t>> out_degree_counts(num_threads);
+  std::unique_ptr<std::atomic<int64_t>[]> in_offsets(new std::atomic<int64_t>[n + 1]);
+  for (int s = 0; s <= n; ++s) in_offsets[s].store(0, std::memory_order_relaxed);
+  ParallelRange(n, num_threads, [&](int t, int64_t begin, int64_t end) {
+    for (int64_t s = begin; s < end; ++s) {
+      int64_t a = offsets[s];
+      for (fst::ArcIterator<fst::StdFst> aiter(ifst, s); !aiter.Done(); aiter.Next(), ++a) {
+        const fst::StdArc& arc = aiter.Value();
+        targets[a] = arc.nextstate;
+        arc_eps[a] = arc.ilabel == 0;
+        ++ilabel_counts[t][arc.ilabel];
+        ++olabel_counts[t][arc.olabel];
+        in_offsets[arc.nextstate + 1].fetch_add(1, std::memory_order_relaxed);
+      }
+      size_t degree = offsets[s + 1] - offsets[s];
+      if (degree >= out_degree_counts[t].size()) out_degree_counts[t].resize(degree + 1, 0);
+      ++out_degree_counts[t][degree];
+    }
+  });
+  for (int t = 0; t < num_threads; ++t) {
+    for (auto& count: ilabel_counts[t]) stats.ilabel_counts[count.first] += count.second;
+    for (auto& count: olabel_counts[t]) stats.olabel_counts[count.first] += count.second;
+    std::vector<int64_t>& degrees = out_degree_counts[t];
+    if (degrees.size() > stats.out_degree_counts.size()) stats.out_degree_counts.resize(degrees.size(), 0);
+    for (size_t d = 0; d < degrees.size(); ++d) stats.out_degree_counts[d] += degrees[d];
+  }
+
+  // Reversed graph for the coaccessibility search.
+  std::vector<int64_t> in_offset_vec(n + 1, 0);
+  for (int s = 0; s < n; ++s) in_offset_vec[s + 1] = in_offset_vec[s] + in_offsets[s + 1].load();
+  for (int s = 0; s <= n; ++s) in_offsets[s].store(in_offset_vec[s], std::memory_order_relaxed);
+  std::vector<int> sources(num_arcs);
+  ParallelRange(n, num_threads, [&](int t, int64_t begin, int64_t end) {
+    for (int64_t s = begin; s < end; ++s) {
+      for (int64_t a = offsets[s]; a < offsets[s + 1]; ++a) {
+        sources[in_offsets[targets[a]].fetch_add(1, std::memory_order_relaxed)] = s;
+      }
+    }
+  });
+
+  std::vector<int> start_states, final_states;
+  if (GetStart() != -1) start_states.push_back(GetStart());
+  for (int s = 0; s < n; ++s) {
+    if (final[s]) final_states.push_back(s);
+  }
+  std::vector<char> accessible = Reach(start_states, offsets, targets, num_threads);
+  std::vector<char> coaccessible = Reach(final_states, in_offset_vec, sources, num_threads);
+  std::vector<int64_t> dead_states;
+  for (int s = 0; s < n; ++s) {
+    stats.num_accessible += accessible[s];
+    stats.num_coaccessible += coaccessible[s];
+    if (!accessible[s]) ++stats.num_unreachable;
+    else if (!coaccessible[s]) ++stats.num_dead_end;
+    if (!accessible[s] || !coaccessible[s]) dead_states.push_back(s);
+  }
+
+  stats.has_epsilon_cycle = HasEpsilonCycle(offsets, targets, arc_eps, num_threads);
+
+  if (connect && !dead_states.empty()) DeleteStates(dead_states);
+  return stats;
+}
@@ -16,7 +16,9 @@
 // along with icassp-oov-recognition. If not, see <http://www.gnu.org/licenses/>.
 
 #include "fst/script/fstscript.h"
+#include<fstream>
 #include<string>
+#include<unordered_map>
 #include<vector>
 
 
@@ -28,6 +30,20 @@ struct Arc {
 };
 
 
+struct GraphStats {
+  int num_states = 0;
+  int64_t num_arcs = 0;
+  int num_accessible = 0;  // reachable from the start state
+  int num_coaccessible = 0;  // can reach a final state
+  int num_unreachable = 0;  // not accessible
+  int num_dead_end = 0;  // accessible but not coaccessible
+  bool has_epsilon_cycle = false;  // cycle of arcs with ilabel 0
+  std::unordered_map<int, int64_t> ilabel_counts;
+  std::unordered_map<int, int64_t> olabel_counts;
+  std::vector<int64_t> out_degree_counts;  // index is the number of arcs leaving a state
+};
+
+
 class WrappedFst {
 public:
   fst::script::VectorFstClass* fst_;
@@ -73,27 +89,42 @@ public:
   void Read(std::string fst_fpath);
 
   static std::vector<std::pair<std::string, WrappedFst*>> ReadArkEntries(std::string fst_fpath) {
-    std::fstream fs;
-    fs.open(fst_fpath, std::fstream::binary | std::fstream::in);
-    const fst::FstReadOptions opts(fst_fpath);
+    std::ifstream fs(fst_fpath, std::ifstream::binary);
     std::vector<std::pair<std::string, WrappedFst*>> lst;
-    while (!fs.eof()) {
-      std::string key;
-      fs >> key;
-      if (key.empty()) break;
-      int space = fs.get();
-      WrappedFst* fst = new WrappedFst();
-      fst->fst_ = fst::script::VectorFstClass::Read<fst::StdArc>(fs, opts);
-      lst.emplace_back(key, fst);
+    std::string key;
+    WrappedFst* fst;
+    try {
+      while ((fst = ReadArkEntry(fs, fst_fpath, &key)) != nullptr) {
+        lst.emplace_back(key, fst);
+      }
+    } catch (...) {
+      for (auto& entry: lst) delete entry.second;
+      throw;
     }
-    fs.close();
     return lst;
   }
 
+  // Reads the next "key fst" entry of an ark, returns nullptr at the end.
+  static WrappedFst* ReadArkEntry(std::istream& strm, std::string source, std::string* key);
+
   void Write(std::string fst_fpath);
 
   void WriteArkEntry(std::string key, std::string fst_fpath);
 
+  // Compact format: varint coded label and nextstate deltas, weights either as floats or (if max_error > 0)
+  // quantized to steps of 2 * max_error, a CRC32 checked header and the arcs in CRC32 checked chunks, so it
+  // is written and read without holding the encoded graph in memory. Symbol tables are not kept. Read and
+  // ReadArkEntries detect the format by its magic number.
+  void WriteCompact(std::string fst_fpath, double max_error=0.);
+
+  void WriteCompactArkEntry(std::string key, std::string fst_fpath, double max_error=0.);
+
+  void WriteCompact(std::ostream& strm, double max_error) const;
+
+  static bool IsCompact(std::istream& strm);
+
+  static fst::script::VectorFstClass* ReadCompact(std::istream& strm, std::string source);
+
   int GetStart() const;
 
   double Final(int state) const;
@@ -110,7 +141,9 @@ public:
 
   void Compose(WrappedFst& other);
 
-  void ShortestPath();
+  // With unique the nshortest paths are distinct as input:output label sequences. This determinizes the
+  // FST, so it must be functional (e.g. an acceptor); unique has no effect for nshortest=1.
+  void ShortestPath(int nshortest=1, bool unique=false);
 
   std::vector<int> States() const;
 
@@ -134,7 +167,10 @@ public:
 
   void NormaliseWeights();
 
-//  bool CheckHasEpsilonLoop(int start, int end);
+  // Computes reachability, input epsilon cycles, label and out-degree statistics with the states split
+  // across threads. If connect is true afterwards deletes the states that are not both accessible and
+  // coaccessible (same result as Connect), the stats describe the graph before that.
+  GraphStats Analyse(int num_threads=0, bool connect=false);
 
   ~WrappedFst() {
     delete fst_;
@@ -173,3 +209,36 @@ public:
     arc_iterator.SetValue(fst::script::ArcClass(sarc));
   }
 };
+
+// Maps the ids of a position dependent phone table (phones.txt, e.g. AH_B) to the ids of the
+// position free phone symbols (e.g. AH). Ids without a position free entry map to -1.
+std::vector<int> ReadPhoneMap(std::string phones_fpath, std::string psym_fpath);
+
+// Reads the (integer) output of lattice-arc-post from post_fpath ("-" for stdin) and writes a linear
+// phone FST for every arc with word unk_id to the ark fst_fpath. The first arc carries -log(posterior).
+// Keys are the plain utterance ids, so an utterance with several <unk> arcs has one entry per arc under the
+// same key (as the earlier grep | cut pipeline produced). Malformed lines are reported on stderr.
+// Returns the number of FSTs written, throws if writing fails.
+int WriteUnkPhoneFsts(std::string post_fpath, int unk_id, const std::vector<int>& phone_map,
+                      std::string fst_fpath, int num_threads=0);
+
+// Reads a symbol table into a vector indexed by id.
+std::vector<std::string> ReadSymbols(std::string sym_fpath);
+
+// For every FST (composed with lm first if it is not null) runs ShortestPath and returns the nshortest output
+// strings ordered by cost. If nshortest > 1 the FSTs are projected to their output labels and epsilons are
+// removed first, so the strings are distinct. Labels in drop_labels and epsilons are removed, the remaining
+// labels are mapped through symbols and joined with separator. The FSTs are modified in place. lm must be
+// ilabel sorted, otherwise composition fails and an exception is thrown. Workers compose with deep copies
+// of lm, at most max_lm_copies of them are held in memory (workers beyond that wait for a free copy).
+std::vector<std::pair<std::string, std::vector<std::string>>> DecodeNBest(
+    const std::vector<std::pair<std::string, WrappedFst*>>& fsts, WrappedFst* lm, int nshortest,
+    const std::vector<int>& drop_labels, const std::vector<std::string>& symbols, std::string separator="",
+    int num_threads=0, int max_lm_copies=4);
+
+// Same as DecodeNBest but reads the FSTs from the ark fst_fpath in batches and writes "key transcript" lines
+// to out_fpath in input order (keys get the suffix -1, -2, ... if nshortest > 1). Returns the number of lines
+// written.
+int WriteNBestTranscripts(std::string fst_fpath, WrappedFst* lm, int nshortest, const std::vector<int>& drop_labels,
+                          const std::vector<std::string>& symbols, std::string out_fpath, std::string separator="",
+                          int num_threads=0, int max_lm_copies=4);
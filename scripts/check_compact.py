@@ -0,0 +1,63 @@
+# Copyright (c) 2021 Idiap Research Institute, http://www.idiap.ch/
+# Written by Rudolf A. Braun <rbraun@idiap.ch>
+#
+# This file is part of icassp-oov-recognition
+#
+# icassp-oov-recognition is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+#
+# icassp-oov-recognition is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with icassp-oov-recognition. If not, see <http://www.gnu.org/licenses/>.
+
+import math
+import os
+import time
+import plac
+from wrappedfst import WrappedFst
+
+
+def timed_read(f):
+    t = time.perf_counter()
+    fst = WrappedFst(f)
+    return fst, time.perf_counter() - t
+
+
+def compare(ref, fst, max_error):
+    # Quantized weights are within max_error, plus the rounding when storing them as floats.
+    tol = max_error * (1. + 1e-5) + 1e-6
+    def close(a, b):
+        if math.isinf(a) or math.isinf(b):
+            return a == b
+        return abs(a - b) <= tol + 1e-6 * abs(a)
+
+    assert fst.num_states() == ref.num_states(), 'number of states differs'
+    assert fst.get_start() == ref.get_start(), 'start state differs'
+    for state in ref.states():
+        assert close(ref.final(state), fst.final(state)), f'final weight of state {state} differs'
+        ref_arcs, arcs = ref.get_arcs(state), fst.get_arcs(state)
+        assert len(ref_arcs) == len(arcs), f'number of arcs of state {state} differs'
+        for a, b in zip(ref_arcs, arcs):
+            assert (a.ilabel, a.olabel, a.nextstate) == (b.ilabel, b.olabel, b.nextstate), f'arc of state {state} differs'
+            assert close(a.weight, b.weight), f'arc weight of state {state} differs: {a.weight} {b.weight}'
+
+
+def main(fst_f, workdir, max_error: ('', 'option', None, float) = 0.001):
+    """ Writes fst_f in the compact format, exact and quantized with max_error, reads it back and compares
+        states, arcs and weights. Also prints the sizes and load times (drop the page cache for cold numbers). """
+    os.makedirs(workdir, exist_ok=True)
+    ref, t_ref = timed_read(fst_f)
+    print(f'standard: {os.path.getsize(fst_f)} bytes, loaded in {t_ref:.3f}s')
+    for err in (0., max_error):
+        out_f = os.path.join(workdir, f'compact_{err}.fst')
+        ref.write_compact(out_f, err)
+        fst, t = timed_read(out_f)
+        compare(ref, fst, err)
+        print(f'compact max_error={err}: {os.path.getsize(out_f)} bytes, loaded in {t:.3f}s, round trip ok')
+
+plac.call(main)
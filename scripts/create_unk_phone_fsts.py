@@ -0,0 +1,28 @@
+# Copyright (c) 2021 Idiap Research Institute, http://www.idiap.ch/
+# Written by Rudolf A. Braun <rbraun@idiap.ch>
+#
+# This file is part of icassp-oov-recognition
+#
+# icassp-oov-recognition is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+#
+# icassp-oov-recognition is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with icassp-oov-recognition. If not, see <http://www.gnu.org/licenses/>.
+
+import plac
+import wrappedfst
+
+
+def main(postf, unk_id: ('', 'positional', None, int), phones_f, psym_f, outfsts, nj: ('', 'option', None, int) = 4):
+    """ postf is the integer output of lattice-arc-post ("-" for stdin). """
+    phone_map = wrappedfst.read_phone_map(phones_f, psym_f)
+    n = wrappedfst.write_unk_phone_fsts(postf, unk_id, phone_map, outfsts, nj)
+    print(f'Wrote {n} unk phone fsts')
+
+plac.call(main)
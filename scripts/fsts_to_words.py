@@ -0,0 +1,35 @@
+# Copyright (c) 2021 Idiap Research Institute, http://www.idiap.ch/
+# Written by Rudolf A. Braun <rbraun@idiap.ch>
+#
+# This file is part of icassp-oov-recognition
+#
+# icassp-oov-recognition is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+#
+# icassp-oov-recognition is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with icassp-oov-recognition. If not, see <http://www.gnu.org/licenses/>.
+
+import plac
+import wrappedfst
+from wrappedfst import WrappedFst
+
+
+def main(infsts, lm_f, lsym_f, outf, drop: ('', 'option', None, str) = '', nshortest: ('', 'option', 'n', int) = 1,
+         nj: ('', 'option', None, int) = 4, lm_copies: ('', 'option', None, int) = 4):
+    """ drop is a comma separated list of label ids to remove from the output, e.g. 179,180,181
+        lm_copies caps how many copies of the lm the nj workers hold in memory """
+    drop_labels = [int(l) for l in drop.split(',') if l]
+    lm = None
+    if lm_f:
+        lm = WrappedFst(lm_f)
+        lm.arc_sort("ilabel")
+    symbols = wrappedfst.read_symbols(lsym_f)
+    wrappedfst.write_nbest_transcripts(infsts, lm, nshortest, drop_labels, symbols, outf, '', nj, lm_copies)
+
+plac.call(main)